@@ -39,7 +39,19 @@
 
 #define MAX_PRESSES 100
 
-static struct hrtimer led1_timer, led2_timer, led3_timer;
+// PWM channel. next_duty is the shadow register written by userspace; the
+// timer applies it at the start of each period.
+typedef struct {
+    struct hrtimer timer;
+    int gpio;
+    int next_duty;
+    bool state;
+    ktime_t period_start;
+} pwm_led_t;
+
+static pwm_led_t led1 = { .gpio = GPIO_LED1 };
+static pwm_led_t led2 = { .gpio = GPIO_LED2 };
+static pwm_led_t led3 = { .gpio = GPIO_LED3 };
 static struct hrtimer btn_poll_timer;
  
 static int device_open(struct inode *, struct file *); 
@@ -76,8 +88,6 @@ typedef struct {
 static button_event_t press_events[MAX_PRESSES];
 static int press_idx = 0;
 
-static ktime_t led1_on, led1_off, led2_on, led2_off, led3_on, led3_off;
-static bool led1_state, led2_state, led3_state;
 static char read_buf[BUF_LEN + 1];
 
 static void init_led_gpios(void)
@@ -92,31 +102,63 @@ static void init_led_gpios(void)
     writel(((1 << 21)|(1 << 6)), addr+1);
 }
 
-static enum hrtimer_restart led1_cb(struct hrtimer *timer)
+// On time for a supported duty, or -1 if the duty is not supported
+static long duty_on_ns(int duty)
 {
-    led1_state = !led1_state;
-    writel((1<<GPIO_LED1), led1_state ? (addr+7) : (addr+10));
-    hrtimer_forward_now(&led1_timer, led1_state ? led1_on : led1_off);
-
-    return HRTIMER_RESTART;
+    switch (duty) {
+        case 0:   return TIME_0;
+        case 25:  return TIME_25;
+        case 50:  return TIME_50;
+        case 75:  return TIME_75;
+        case 100: return TIME_100;
+        default:  return -1;
+    }
 }
 
-static enum hrtimer_restart led2_cb(struct hrtimer *timer)
+static enum hrtimer_restart led_cb(struct hrtimer *timer)
 {
-    led2_state = !led2_state;
-    writel((1<<GPIO_LED2), led2_state ? (addr+7) : (addr+10));
-    hrtimer_forward_now(&led2_timer, led2_state ? led2_on : led2_off);
+    pwm_led_t *led = container_of(timer, pwm_led_t, timer);
+    ktime_t now = ktime_get();
+    ktime_t on_end;
+    int duty;
+    long on_ns;
+
+    if (led->state) { // End of on phase
+        led->state = false;
+        writel((1<<led->gpio), addr+10);
+        hrtimer_set_expires(timer, ktime_add_ns(led->period_start, TIME_100));
+        return HRTIMER_RESTART;
+    }
+
+    // Period boundary: resync to the 2 ms grid, skipping any periods missed while late
+    hrtimer_set_expires(timer, led->period_start);
+    hrtimer_forward(timer, now, ktime_set(0, TIME_100));
+    led->period_start = ktime_sub_ns(hrtimer_get_expires(timer), TIME_100);
+
+    // Apply the latched duty
+    duty = READ_ONCE(led->next_duty);
+    on_ns = duty_on_ns(duty);
+    on_end = ktime_add_ns(led->period_start, on_ns);
+
+    if (on_ns == TIME_0 || on_ns == TIME_100) { // Steady level for the whole period
+        writel((1<<led->gpio), on_ns ? (addr+7) : (addr+10));
+    } else if (ktime_before(now, on_end)) {
+        led->state = true;
+        writel((1<<led->gpio), addr+7);
+        hrtimer_set_expires(timer, on_end);
+    } else { // Too late for this period's on phase; skip it rather than emit a runt
+        writel((1<<led->gpio), addr+10);
+    }
 
     return HRTIMER_RESTART;
 }
 
-static enum hrtimer_restart led3_cb(struct hrtimer *timer)
+static void start_led(pwm_led_t *led)
 {
-    led3_state = !led3_state;
-    writel((1<<GPIO_LED3), led3_state ? (addr+7) : (addr+10));
-    hrtimer_forward_now(&led3_timer, led3_state ? led3_on : led3_off);
-
-    return HRTIMER_RESTART;
+    hrtimer_init(&led->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    led->timer.function = &led_cb;
+    led->period_start = ktime_get();
+    hrtimer_start(&led->timer, ktime_add_ns(led->period_start, TIME_100), HRTIMER_MODE_ABS);
 }
 
 static void record_press(int button_id)
@@ -226,12 +268,9 @@ static int __init chardev_init(void)
     init_led_gpios();
 
     pr_info("Initing LED timers...\n");
-    hrtimer_init(&led1_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
-    hrtimer_init(&led2_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
-    hrtimer_init(&led3_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
-    led1_timer.function = &led1_cb;
-    led2_timer.function = &led2_cb;
-    led3_timer.function = &led3_cb;
+    start_led(&led1);
+    start_led(&led2);
+    start_led(&led3);
 
     pr_info("Initing button poll timer...\n");
     hrtimer_init(&btn_poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
@@ -245,9 +284,9 @@ static int __init chardev_init(void)
 
 static void __exit chardev_exit(void) 
 {
-    hrtimer_cancel(&led1_timer);
-    hrtimer_cancel(&led2_timer);
-    hrtimer_cancel(&led3_timer);
+    hrtimer_cancel(&led1.timer);
+    hrtimer_cancel(&led2.timer);
+    hrtimer_cancel(&led3.timer);
     hrtimer_cancel(&btn_poll_timer);
 
     device_destroy(cls, MKDEV(major, 0)); 
@@ -310,7 +349,7 @@ static ssize_t device_write(struct file *filp, const char __user *buffer, size_t
     char write_buf[BUF_LEN + 1] = {0};
     int led, duty;
     int i;
-    ktime_t on, off;
+    pwm_led_t *target;
 
     pr_info("device_write(%p, %p, %zu)\n", filp, buffer, length);
 
@@ -321,29 +360,28 @@ static ssize_t device_write(struct file *filp, const char __user *buffer, size_t
         }
     }
     write_buf[length] = '\0';
-    pr_info("A\n");
     if (sscanf(write_buf, "%d %d", &led, &duty) != 2) {
         pr_info("device_write: bad format '%s'\n", write_buf);
         return -EINVAL;
     }
 
-    // Select on and off time based on duty
-    switch (duty) {
-        case 0:   pr_info("got duty 0\n"); on = ktime_set(0, TIME_0);   off = ktime_set(0, TIME_100); break;
-        case 25:  pr_info("got duty 25\n"); on = ktime_set(0, TIME_25);  off = ktime_set(0, TIME_75); break;
-        case 50:  pr_info("got duty 50\n"); on = ktime_set(0, TIME_50);  off = ktime_set(0, TIME_50); break;
-        case 75:  pr_info("got duty 75\n"); on = ktime_set(0, TIME_75);  off = ktime_set(0, TIME_25); break;
-        case 100: pr_info("got duty 100\n"); on = ktime_set(0, TIME_100); off = ktime_set(0,   TIME_0); break;
-        default:  pr_info("device_write: invalid duty '%d'; only supports 0, 25, 50, 75, 100!\n", duty); return -EINVAL;
+    if (duty_on_ns(duty) < 0) {
+        pr_info("device_write: invalid duty '%d'; only supports 0, 25, 50, 75, 100!\n", duty);
+        return -EINVAL;
     }
-    pr_info("B\n");
+
     switch (led) {
-    case 1:  pr_info("led1\n"); led1_on=on; led1_off=off; hrtimer_cancel(&led1_timer); led1_state=false; hrtimer_start(&led1_timer, ktime_set(0,0), HRTIMER_MODE_REL); break;
-    case 2:  pr_info("led2\n"); led2_on=on; led2_off=off; hrtimer_cancel(&led2_timer); led2_state=false; hrtimer_start(&led2_timer, ktime_set(0,0), HRTIMER_MODE_REL); break;
-    case 3:  pr_info("led3\n"); led3_on=on; led3_off=off; hrtimer_cancel(&led3_timer); led3_state=false; hrtimer_start(&led3_timer, ktime_set(0,0), HRTIMER_MODE_REL); break;
+    case 1:  target = &led1; break;
+    case 2:  target = &led2; break;
+    case 3:  target = &led3; break;
     default: pr_info("device_write: invalid LED number '%d'\n", led); return -EINVAL;
     }
-    pr_info("C\n");
+
+    // Latched by led_cb at the next period boundary; rewriting the current duty is a no-op
+    if (READ_ONCE(target->next_duty) != duty) {
+        pr_info("led%d: duty %d\n", led, duty);
+        WRITE_ONCE(target->next_duty, duty);
+    }
 
     return length;
 }
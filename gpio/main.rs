@@ -0,0 +1,330 @@
+// Userspace backend: drives the same buttons and LEDs as dev/ and sys/ through
+// the GPIO character device (uAPI v2) instead of a kernel module.
+//
+// Build: rustc -O main.rs -o button_pwm_gpio
+// Run:   ./button_pwm_gpio [/dev/gpiochipN]   (defaults to /dev/gpiochip0)
+//
+// For benchmarking, point it at a gpio-sim bank with at least 18 lines; it
+// prints PWM edge lateness, button event latency and CPU usage once a second.
+// The kernel modules cannot run on that setup: they ioremap the BCM2711 GPIO
+// block directly and report no timing stats, so a side-by-side comparison
+// still needs real hardware and external measurement on their side.
+
+use std::collections::VecDeque;
+use std::env;
+use std::fs::{File, OpenOptions};
+use std::io::{Error, Read};
+use std::mem;
+use std::os::raw::{c_int, c_long, c_ulong, c_void};
+use std::os::unix::io::{AsRawFd, FromRawFd};
+
+const GPIO_LED1: u32 = 2;
+const GPIO_LED2: u32 = 17;
+const GPIO_LED3: u32 = 12;
+const GPIO_BTN1: u32 = 5;
+const GPIO_BTN2: u32 = 6;
+
+const PWM_PERIOD_NS: u64 = 2_000_000; // 2.0 ms period, same as the kernel modules
+const PWM_SLOTS: u64 = 4; // 25% duty resolution
+const SLOT_NS: u64 = PWM_PERIOD_NS / PWM_SLOTS;
+const SPEED_WINDOW_NS: u64 = 10_000_000_000;
+const MAX_PRESSES: usize = 100;
+const EVENT_BATCH: usize = 16;
+
+// --- linux/gpio.h (uAPI v2) ---
+
+const GPIO_V2_LINES_MAX: usize = 64;
+const GPIO_MAX_NAME_SIZE: usize = 32;
+const GPIO_V2_LINE_NUM_ATTRS_MAX: usize = 10;
+
+const GPIO_V2_LINE_FLAG_INPUT: u64 = 1 << 2;
+const GPIO_V2_LINE_FLAG_OUTPUT: u64 = 1 << 3;
+const GPIO_V2_LINE_FLAG_EDGE_FALLING: u64 = 1 << 5;
+const GPIO_V2_LINE_FLAG_BIAS_PULL_UP: u64 = 1 << 8;
+const GPIO_V2_LINE_FLAG_EVENT_CLOCK_HTE: u64 = 1 << 12;
+
+#[repr(C)]
+#[derive(Clone, Copy)]
+struct GpioV2LineAttribute {
+    id: u32,
+    padding: u32,
+    value: u64, // union of flags / values / debounce_period_us
+}
+
+#[repr(C)]
+#[derive(Clone, Copy)]
+struct GpioV2LineConfigAttribute {
+    attr: GpioV2LineAttribute,
+    mask: u64,
+}
+
+#[repr(C)]
+struct GpioV2LineConfig {
+    flags: u64,
+    num_attrs: u32,
+    padding: [u32; 5],
+    attrs: [GpioV2LineConfigAttribute; GPIO_V2_LINE_NUM_ATTRS_MAX],
+}
+
+#[repr(C)]
+struct GpioV2LineRequest {
+    offsets: [u32; GPIO_V2_LINES_MAX],
+    consumer: [u8; GPIO_MAX_NAME_SIZE],
+    config: GpioV2LineConfig,
+    num_lines: u32,
+    event_buffer_size: u32,
+    padding: [u32; 5],
+    fd: i32,
+}
+
+#[repr(C)]
+struct GpioV2LineValues {
+    bits: u64,
+    mask: u64,
+}
+
+#[repr(C)]
+#[derive(Clone, Copy)]
+struct GpioV2LineEvent {
+    timestamp_ns: u64,
+    id: u32,
+    offset: u32,
+    seqno: u32,
+    line_seqno: u32,
+    padding: [u32; 6],
+}
+
+const fn iowr(nr: c_ulong, size: usize) -> c_ulong {
+    (3 << 30) | ((size as c_ulong) << 16) | (0xB4 << 8) | nr
+}
+
+const GPIO_V2_GET_LINE_IOCTL: c_ulong = iowr(0x07, mem::size_of::<GpioV2LineRequest>());
+const GPIO_V2_LINE_SET_VALUES_IOCTL: c_ulong = iowr(0x0F, mem::size_of::<GpioV2LineValues>());
+
+// --- libc ---
+
+const CLOCK_MONOTONIC: c_int = 1;
+const CLOCK_PROCESS_CPUTIME_ID: c_int = 2;
+const POLLIN: i16 = 0x1;
+
+#[repr(C)]
+struct Timespec {
+    tv_sec: c_long,
+    tv_nsec: c_long,
+}
+
+#[repr(C)]
+struct PollFd {
+    fd: c_int,
+    events: i16,
+    revents: i16,
+}
+
+extern "C" {
+    fn ioctl(fd: c_int, request: c_ulong, ...) -> c_int;
+    fn ppoll(fds: *mut PollFd, nfds: c_ulong, timeout: *const Timespec, sigmask: *const c_void) -> c_int;
+    fn clock_gettime(clock: c_int, tp: *mut Timespec) -> c_int;
+}
+
+fn clock_ns(clock: c_int) -> u64 {
+    let mut ts = Timespec { tv_sec: 0, tv_nsec: 0 };
+    unsafe { clock_gettime(clock, &mut ts) };
+    ts.tv_sec as u64 * 1_000_000_000 + ts.tv_nsec as u64
+}
+
+fn request_lines(chip: &File, offsets: &[u32], flags: u64) -> Result<File, Error> {
+    let mut req: GpioV2LineRequest = unsafe { mem::zeroed() };
+    req.offsets[..offsets.len()].copy_from_slice(offsets);
+    let consumer = b"button-pwm-led";
+    req.consumer[..consumer.len()].copy_from_slice(consumer);
+    req.config.flags = flags;
+    req.num_lines = offsets.len() as u32;
+
+    if unsafe { ioctl(chip.as_raw_fd(), GPIO_V2_GET_LINE_IOCTL, &mut req) } < 0 {
+        return Err(Error::last_os_error());
+    }
+    Ok(unsafe { File::from_raw_fd(req.fd) })
+}
+
+fn set_leds(leds: &File, bits: u64) {
+    let mut values = GpioV2LineValues { bits, mask: 0b111 };
+    if unsafe { ioctl(leds.as_raw_fd(), GPIO_V2_LINE_SET_VALUES_IOCTL, &mut values) } < 0 {
+        eprintln!("Failed to set LEDs: {}", Error::last_os_error());
+    }
+}
+
+fn map_speed_to_leds(speed: u32) -> (u32, u32, u32) {
+    match speed {
+        0 => (0, 0, 0),
+        1..=5 => (25, 0, 0),
+        6..=10 => (50, 0, 0),
+        11..=15 => (75, 0, 0),
+        16..=20 => (100, 0, 0),
+        21..=25 => (100, 25, 0),
+        26..=30 => (100, 50, 0),
+        31..=35 => (100, 75, 0),
+        36..=40 => (100, 100, 0),
+        41..=45 => (100, 100, 25),
+        46..=50 => (100, 100, 50),
+        51..=55 => (100, 100, 75),
+        56..=60 => (100, 100, 100),
+        _ => (100, 100, 100),
+    }
+}
+
+// LED bit mask for a PWM slot: an LED is on while slot * 25% is below its duty.
+fn slot_bits(duties: (u32, u32, u32), slot: u64) -> u64 {
+    let level = (slot * 100 / PWM_SLOTS) as u32;
+    (duties.0 > level) as u64 | ((duties.1 > level) as u64) << 1 | ((duties.2 > level) as u64) << 2
+}
+
+// Presses are only recorded when the button differs from the last one, so the
+// speed is simply the number of presses left in the window.
+fn calculate_speed(presses: &mut VecDeque<(u64, u32)>, now_ns: u64) -> u32 {
+    while let Some(&(ts, _)) = presses.front() {
+        if now_ns.saturating_sub(ts) <= SPEED_WINDOW_NS {
+            break;
+        }
+        presses.pop_front();
+    }
+    presses.len() as u32
+}
+
+#[derive(Default)]
+struct Stats {
+    slots: u64,
+    edges: u64,
+    edge_late_sum_ns: u64,
+    edge_late_max_ns: u64,
+    events: u64,
+    event_lat_sum_ns: u64,
+    event_lat_max_ns: u64,
+}
+
+fn main() {
+    let chip_path = env::args().nth(1).unwrap_or_else(|| "/dev/gpiochip0".to_string());
+    let chip = OpenOptions::new().read(true).write(true).open(&chip_path).expect("Failed to open GPIO chip");
+
+    let leds = request_lines(&chip, &[GPIO_LED1, GPIO_LED2, GPIO_LED3], GPIO_V2_LINE_FLAG_OUTPUT)
+        .expect("Failed to request LED lines");
+
+    // Prefer hardware timestamps; fall back to CLOCK_MONOTONIC when no HTE provider exists.
+    let btn_flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_FALLING | GPIO_V2_LINE_FLAG_BIAS_PULL_UP;
+    let (mut buttons, hte) = match request_lines(&chip, &[GPIO_BTN1, GPIO_BTN2], btn_flags | GPIO_V2_LINE_FLAG_EVENT_CLOCK_HTE) {
+        Ok(f) => (f, true),
+        Err(_) => (request_lines(&chip, &[GPIO_BTN1, GPIO_BTN2], btn_flags).expect("Failed to request button lines"), false),
+    };
+    println!("Using {} ({} event timestamps)", chip_path, if hte { "HTE" } else { "monotonic" });
+
+    let mut presses: VecDeque<(u64, u32)> = VecDeque::with_capacity(MAX_PRESSES);
+    let mut last_button_pressed = 0;
+    let mut duties = (0, 0, 0);
+    let mut next_duties = duties; // latched into duties at the start of each period
+    let mut led_bits = 0;
+    set_leds(&leds, led_bits);
+
+    let mut stats = Stats::default();
+    let mut events = [GpioV2LineEvent { timestamp_ns: 0, id: 0, offset: 0, seqno: 0, line_seqno: 0, padding: [0; 6] }; EVENT_BATCH];
+    let start_ns = clock_ns(CLOCK_MONOTONIC);
+    let mut next_edge = start_ns;
+    let mut slot = 0;
+    let mut next_report = start_ns + 1_000_000_000;
+    let mut cpu_at_report = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+
+    loop {
+        // Sleep until the next PWM edge or a button event, whichever comes first.
+        let now = clock_ns(CLOCK_MONOTONIC);
+        if now < next_edge {
+            let wait = next_edge - now;
+            let timeout = Timespec { tv_sec: (wait / 1_000_000_000) as c_long, tv_nsec: (wait % 1_000_000_000) as c_long };
+            let mut pfd = PollFd { fd: buttons.as_raw_fd(), events: POLLIN, revents: 0 };
+            let ret = unsafe { ppoll(&mut pfd, 1, &timeout, std::ptr::null()) };
+
+            if ret > 0 && pfd.revents & POLLIN != 0 {
+                // Drain up to EVENT_BATCH events with a single read.
+                let buf = unsafe {
+                    std::slice::from_raw_parts_mut(events.as_mut_ptr() as *mut u8, mem::size_of_val(&events))
+                };
+                let n = buttons.read(buf).expect("Failed to read line events") / mem::size_of::<GpioV2LineEvent>();
+                let now = clock_ns(CLOCK_MONOTONIC);
+
+                for ev in &events[..n] {
+                    let button = if ev.offset == GPIO_BTN1 { 1 } else { 2 };
+                    if last_button_pressed != button {
+                        if presses.len() == MAX_PRESSES {
+                            presses.pop_front();
+                        }
+                        // HTE stamps come from the provider's counter, so the speed window
+                        // uses the monotonic receive time instead.
+                        presses.push_back((if hte { now } else { ev.timestamp_ns }, button));
+                        last_button_pressed = button;
+                    }
+                    if !hte {
+                        let lat = now.saturating_sub(ev.timestamp_ns);
+                        stats.event_lat_sum_ns += lat;
+                        stats.event_lat_max_ns = stats.event_lat_max_ns.max(lat);
+                    }
+                }
+                stats.events += n as u64;
+
+                next_duties = map_speed_to_leds(calculate_speed(&mut presses, now));
+            }
+            continue;
+        }
+
+        // PWM edge: one multi-line set-values ioctl, and only if a line changes.
+        if slot == 0 {
+            duties = next_duties;
+        }
+
+        let late = now - next_edge;
+        stats.slots += 1;
+        stats.edge_late_sum_ns += late;
+        stats.edge_late_max_ns = stats.edge_late_max_ns.max(late);
+
+        let bits = slot_bits(duties, slot);
+        if bits != led_bits {
+            set_leds(&leds, bits);
+            led_bits = bits;
+            stats.edges += 1;
+        }
+
+        slot = (slot + 1) % PWM_SLOTS;
+        next_edge += SLOT_NS;
+        if next_edge < now {
+            // Overran by more than a slot; resynchronise instead of bursting.
+            next_edge = now + SLOT_NS - (now - start_ns) % SLOT_NS;
+            slot = ((next_edge - start_ns) / SLOT_NS) % PWM_SLOTS;
+        }
+
+        if now >= next_report {
+            let speed = calculate_speed(&mut presses, now);
+            next_duties = map_speed_to_leds(speed);
+            let cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+
+            // HTE stamps are not on CLOCK_MONOTONIC, so event latency cannot be measured.
+            let latency = if hte {
+                "n/a".to_string()
+            } else if stats.events > 0 {
+                format!("avg {} ns max {} ns", stats.event_lat_sum_ns / stats.events, stats.event_lat_max_ns)
+            } else {
+                "avg - max -".to_string()
+            };
+
+            println!("Speed: {}, Duty Cycle: LED1: {}, LED2: {}, LED3: {}", speed, next_duties.0, next_duties.1, next_duties.2);
+            println!(
+                "  edges: {} set-values, late avg {} ns max {} ns | events: {}, latency {} | cpu {:.2}%",
+                stats.edges,
+                stats.edge_late_sum_ns / stats.slots.max(1),
+                stats.edge_late_max_ns,
+                stats.events,
+                latency,
+                (cpu - cpu_at_report) as f64 / 1e7,
+            );
+
+            stats = Stats::default();
+            cpu_at_report = cpu;
+            next_report += 1_000_000_000;
+        }
+    }
+}
@@ -34,18 +34,27 @@
 
 #define MAX_PRESSES 100
 
-
-static struct hrtimer led1_timer, led2_timer, led3_timer, btn_poll_timer;
+// PWM channel. next_duty is the shadow register written through sysfs; the
+// timer applies it at the start of each period.
+typedef struct {
+    struct hrtimer timer;
+    int gpio;
+    int next_duty;
+    bool state;
+    ktime_t period_start;
+} pwm_led_t;
+
+static pwm_led_t led1 = { .gpio = GPIO_LED1 };
+static pwm_led_t led2 = { .gpio = GPIO_LED2 };
+static pwm_led_t led3 = { .gpio = GPIO_LED3 };
+static struct hrtimer btn_poll_timer;
 static struct kobject *project_kobj;
 static uint32_t *addr = NULL;
 
-static int led1_duty = 0, led2_duty = 0, led3_duty = 0;
 static int last_btn1 = 1, last_btn2 = 1;
 static int last_button_pressed = 0;
 static int speed = 0;
 
-static ktime_t led1_on, led1_off, led2_on, led2_off, led3_on, led3_off;
-static bool led1_state, led2_state, led3_state;
 static char read_buf[BUF_LEN + 1];
 
 typedef struct {
@@ -68,31 +77,63 @@ static void init_led_gpios(void)
     writel(((1 << 21)|(1 << 6)), addr+1);
 }
 
-static enum hrtimer_restart led1_cb(struct hrtimer *timer)
+// On time for a supported duty, or -1 if the duty is not supported
+static long duty_on_ns(int duty)
 {
-    led1_state = !led1_state;
-    writel((1<<GPIO_LED1), led1_state ? (addr+7) : (addr+10));
-    hrtimer_forward_now(&led1_timer, led1_state ? led1_on : led1_off);
-    
-    return HRTIMER_RESTART;
+    switch (duty) {
+        case 0:   return TIME_0;
+        case 25:  return TIME_25;
+        case 50:  return TIME_50;
+        case 75:  return TIME_75;
+        case 100: return TIME_100;
+        default:  return -1;
+    }
 }
 
-static enum hrtimer_restart led2_cb(struct hrtimer *timer)
+static enum hrtimer_restart led_cb(struct hrtimer *timer)
 {
-    led2_state = !led2_state;
-    writel((1<<GPIO_LED2), led2_state ? (addr+7) : (addr+10));
-    hrtimer_forward_now(&led2_timer, led2_state ? led2_on : led2_off);
+    pwm_led_t *led = container_of(timer, pwm_led_t, timer);
+    ktime_t now = ktime_get();
+    ktime_t on_end;
+    int duty;
+    long on_ns;
+
+    if (led->state) { // End of on phase
+        led->state = false;
+        writel((1<<led->gpio), addr+10);
+        hrtimer_set_expires(timer, ktime_add_ns(led->period_start, TIME_100));
+        return HRTIMER_RESTART;
+    }
+
+    // Period boundary: resync to the 2 ms grid, skipping any periods missed while late
+    hrtimer_set_expires(timer, led->period_start);
+    hrtimer_forward(timer, now, ktime_set(0, TIME_100));
+    led->period_start = ktime_sub_ns(hrtimer_get_expires(timer), TIME_100);
+
+    // Apply the latched duty
+    duty = READ_ONCE(led->next_duty);
+    on_ns = duty_on_ns(duty);
+    on_end = ktime_add_ns(led->period_start, on_ns);
+
+    if (on_ns == TIME_0 || on_ns == TIME_100) { // Steady level for the whole period
+        writel((1<<led->gpio), on_ns ? (addr+7) : (addr+10));
+    } else if (ktime_before(now, on_end)) {
+        led->state = true;
+        writel((1<<led->gpio), addr+7);
+        hrtimer_set_expires(timer, on_end);
+    } else { // Too late for this period's on phase; skip it rather than emit a runt
+        writel((1<<led->gpio), addr+10);
+    }
 
     return HRTIMER_RESTART;
 }
 
-static enum hrtimer_restart led3_cb(struct hrtimer *timer)
+static void start_led(pwm_led_t *led)
 {
-    led3_state = !led3_state;
-    writel((1<<GPIO_LED3), led3_state ? (addr+7) : (addr+10));
-    hrtimer_forward_now(&led3_timer, led3_state ? led3_on : led3_off);
-
-    return HRTIMER_RESTART;
+    hrtimer_init(&led->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    led->timer.function = &led_cb;
+    led->period_start = ktime_get();
+    hrtimer_start(&led->timer, ktime_add_ns(led->period_start, TIME_100), HRTIMER_MODE_ABS);
 }
 
 static void record_press(int button_id)
@@ -190,7 +231,7 @@ static ssize_t speed_show(struct kobject *kobj, struct kobj_attribute *attr, cha
 
 static struct kobj_attribute speed_attr = __ATTR(speed, 0660, speed_show, NULL);
 
-static ssize_t led1_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+static ssize_t led_store(pwm_led_t *led, const char *buf, size_t count)
 {
     int duty;
 
@@ -199,74 +240,37 @@ static ssize_t led1_store(struct kobject *kobj, struct kobj_attribute *attr, con
         return -EINVAL;
     }
 
-    switch (duty) {
-        case 0:   pr_info("got duty 0\n"); led1_on = ktime_set(0, TIME_0);   led1_off = ktime_set(0, TIME_100); break;
-        case 25:  pr_info("got duty 25\n"); led1_on = ktime_set(0, TIME_25);  led1_off = ktime_set(0, TIME_75); break;
-        case 50:  pr_info("got duty 50\n"); led1_on = ktime_set(0, TIME_50);  led1_off = ktime_set(0, TIME_50); break;
-        case 75:  pr_info("got duty 75\n"); led1_on = ktime_set(0, TIME_75);  led1_off = ktime_set(0, TIME_25); break;
-        case 100: pr_info("got duty 100\n"); led1_on = ktime_set(0, TIME_100); led1_off = ktime_set(0,   TIME_0); break;
-        default:  pr_info("device_write: invalid duty '%d'; only supports 0, 25, 50, 75, 100!\n", duty); return -EINVAL;
+    if (duty_on_ns(duty) < 0) {
+        pr_info("device_write: invalid duty '%d'; only supports 0, 25, 50, 75, 100!\n", duty);
+        return -EINVAL;
     }
 
-    hrtimer_cancel(&led1_timer);
-    led1_state=false;
-    hrtimer_start(&led1_timer, ktime_set(0,0), HRTIMER_MODE_REL);
+    // Latched by led_cb at the next period boundary; rewriting the current duty is a no-op
+    if (READ_ONCE(led->next_duty) != duty) {
+        pr_info("got duty %d\n", duty);
+        WRITE_ONCE(led->next_duty, duty);
+    }
 
     return count;
 }
 
+static ssize_t led1_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
+{
+    return led_store(&led1, buf, count);
+}
+
 static struct kobj_attribute led1_attr = __ATTR(led1, 0660, NULL, led1_store);
 
 static ssize_t led2_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
 {
-    int duty;
-
-    if (sscanf(buf, "%d", &duty) != 1) {
-        pr_info("device_write: bad format '%s'\n", buf);
-        return -EINVAL;
-    }
-
-    switch (duty) {
-        case 0:   pr_info("got duty 0\n"); led2_on = ktime_set(0, TIME_0);   led2_off = ktime_set(0, TIME_100); break;
-        case 25:  pr_info("got duty 25\n"); led2_on = ktime_set(0, TIME_25);  led2_off = ktime_set(0, TIME_75); break;
-        case 50:  pr_info("got duty 50\n"); led2_on = ktime_set(0, TIME_50);  led2_off = ktime_set(0, TIME_50); break;
-        case 75:  pr_info("got duty 75\n"); led2_on = ktime_set(0, TIME_75);  led2_off = ktime_set(0, TIME_25); break;
-        case 100: pr_info("got duty 100\n"); led2_on = ktime_set(0, TIME_100); led2_off = ktime_set(0,   TIME_0); break;
-        default:  pr_info("device_write: invalid duty '%d'; only supports 0, 25, 50, 75, 100!\n", duty); return -EINVAL;
-    }
-
-    hrtimer_cancel(&led2_timer);
-    led1_state=false;
-    hrtimer_start(&led2_timer, ktime_set(0,0), HRTIMER_MODE_REL);
-
-    return count;
+    return led_store(&led2, buf, count);
 }
 
 static struct kobj_attribute led2_attr = __ATTR(led2, 0660, NULL, led2_store);
 
 static ssize_t led3_store(struct kobject *kobj, struct kobj_attribute *attr, const char *buf, size_t count)
 {
-    int duty;
-
-    if (sscanf(buf, "%d", &duty) != 1) {
-        pr_info("device_write: bad format '%s'\n", buf);
-        return -EINVAL;
-    }
-
-    switch (duty) {
-        case 0:   pr_info("got duty 0\n"); led3_on = ktime_set(0, TIME_0);   led3_off = ktime_set(0, TIME_100); break;
-        case 25:  pr_info("got duty 25\n"); led3_on = ktime_set(0, TIME_25);  led3_off = ktime_set(0, TIME_75); break;
-        case 50:  pr_info("got duty 50\n"); led3_on = ktime_set(0, TIME_50);  led3_off = ktime_set(0, TIME_50); break;
-        case 75:  pr_info("got duty 75\n"); led3_on = ktime_set(0, TIME_75);  led3_off = ktime_set(0, TIME_25); break;
-        case 100: pr_info("got duty 100\n"); led3_on = ktime_set(0, TIME_100); led3_off = ktime_set(0,   TIME_0); break;
-        default:  pr_info("device_write: invalid duty '%d'; only supports 0, 25, 50, 75, 100!\n", duty); return -EINVAL;
-    }
-
-    hrtimer_cancel(&led3_timer);
-    led1_state=false;
-    hrtimer_start(&led3_timer, ktime_set(0,0), HRTIMER_MODE_REL);
-
-    return count;
+    return led_store(&led3, buf, count);
 }
 
 static struct kobj_attribute led3_attr = __ATTR(led3, 0660, NULL, led3_store);
@@ -290,26 +294,29 @@ static int __init project_init(void)
     int retval;
 
     pr_info("project_sys: Module initialized\n");
-    addr = ioremap(GPIO_BASE_ADDR, 4*16);
+
+    pr_info("Initing LED GPIOs...\n");
+    init_led_gpios();
+    if (!addr)
+        return -ENOMEM;
 
     project_kobj = kobject_create_and_add(DEVICE_NAME, kernel_kobj);
-    if (!project_kobj)
+    if (!project_kobj) {
+        iounmap(addr);
         return -ENOMEM;
+    }
 
     retval = sysfs_create_group(project_kobj, &attr_group);
-    if (retval)
+    if (retval) {
         kobject_put(project_kobj);
-
-    pr_info("Initing LED GPIOs...\n");
-    init_led_gpios();
+        iounmap(addr);
+        return retval;
+    }
 
     pr_info("Initing LED timers...\n");
-    hrtimer_init(&led1_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
-    hrtimer_init(&led2_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
-    hrtimer_init(&led3_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
-    led1_timer.function = &led1_cb;
-    led2_timer.function = &led2_cb;
-    led3_timer.function = &led3_cb;
+    start_led(&led1);
+    start_led(&led2);
+    start_led(&led3);
 
     pr_info("Initing button poll timer...\n");
     hrtimer_init(&btn_poll_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
@@ -321,9 +328,9 @@ static int __init project_init(void)
 
 static void __exit project_exit(void)
 {
-    hrtimer_cancel(&led1_timer);
-    hrtimer_cancel(&led2_timer);
-    hrtimer_cancel(&led3_timer);
+    hrtimer_cancel(&led1.timer);
+    hrtimer_cancel(&led2.timer);
+    hrtimer_cancel(&led3.timer);
     hrtimer_cancel(&btn_poll_timer);
 
     iounmap(addr);